@@ -1,17 +1,47 @@
 #include "G4ShowerMap.hh"
+#include <algorithm>
+#include <chrono>
 
-G4ShowerMap::Analysis* G4ShowerMap::Analysis::Instance() {
-  static G4ThreadLocal Analysis* analysis = 0;
-  if ( analysis == 0 ) analysis = new Analysis;
+template<class C>
+G4ShowerMap::TAnalysis<C>* G4ShowerMap::TAnalysis<C>::Instance() {
+  static G4ThreadLocal TAnalysis* analysis = 0;
+  if ( analysis == 0 ) analysis = new TAnalysis;
   return analysis;
 }
 
-bool G4ShowerMap::Analysis::GetHeads( std::vector<int>& result , const conditions::conditionbase& cond ) {
+
+namespace {
+  //Used by Update in concurrent mode, called with the lock of the node held
+  struct UpdateOp {
+    UpdateOp( G4double value , const G4ShowerMap::conditions::conditionbase& cond ) : m_value(value), m_cond(cond) {}
+    bool operator()( G4ShowerMap::Analysis::struct_type& _data ) const {
+      if ( ! m_cond(_data) ) return false;
+      _data.data = m_value;
+      return true;
+    }
+    G4double m_value;
+    const G4ShowerMap::conditions::conditionbase& m_cond;
+  };
+  //Used by Accumulate, in concurrent mode it is called with the lock of the node held
+  struct AccumulateOp {
+    AccumulateOp( G4double delta , const G4ShowerMap::conditions::conditionbase& cond ) : m_delta(delta), m_cond(cond) {}
+    bool operator()( G4ShowerMap::Analysis::struct_type& _data ) const {
+      if ( ! m_cond(_data) ) return false;
+      _data.data += m_delta;
+      return true;
+    }
+    G4double m_delta;
+    const G4ShowerMap::conditions::conditionbase& m_cond;
+  };
+}
+
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::GetHeads( std::vector<int>& result , const conditions::conditionbase& cond ) {
   //This algorithm should be optimized, for example skipping when I analyse twice the same branch
   bool found = false;
-  baseclass::map_type::iterator it = m_map.begin();
+  const_iterator it = First();
   std::map<int,bool> helper;//This is used to speedup algorithm
-  while ( it != m_map.end() ) {
+  while ( it != End() ) {
     int idx = -1; //Default ids
     baseclass::Select( it->first );//This is for sure valid
     do { 
@@ -35,16 +65,18 @@ bool G4ShowerMap::Analysis::GetHeads( std::vector<int>& result , const condition
   return found;
 }
 
-bool G4ShowerMap::Analysis::Matches( int id , const conditions::conditionbase& cond ) {
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::Matches( int id , const conditions::conditionbase& cond ) {
    if ( baseclass::Exists(id) ) {
       baseclass::Select(id);
-      const baseclass::value_type& _data = baseclass::GetData();
+      const typename baseclass::value_type& _data = baseclass::GetData();
       if ( cond(_data) ) return true;
   }
   return false; 
 }
 
-bool G4ShowerMap::Analysis::GetValue( int id , double& result, const G4ShowerMap::conditions::conditionbase& cond  ) {
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::GetValue( int id , double& result, const G4ShowerMap::conditions::conditionbase& cond  ) {
   if ( baseclass::Exists(id) ) {
       baseclass::Select(id);
       result = baseclass::Data(cond);
@@ -53,7 +85,12 @@ bool G4ShowerMap::Analysis::GetValue( int id , double& result, const G4ShowerMap
   return false;
 }
 
-bool G4ShowerMap::Analysis::Update( int id , G4double value , const conditions::conditionbase& cond ) {
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::Update( int id , G4double value , const conditions::conditionbase& cond ) {
+  if ( baseclass::IsConcurrent() ) {
+    UpdateOp op( value , cond );
+    return baseclass::ModifyConcurrent( id , op );
+  }
   if ( baseclass::Exists(id) ) {
       baseclass::Select(id);
       if ( cond(baseclass::GetData()) ) {
@@ -64,7 +101,27 @@ bool G4ShowerMap::Analysis::Update( int id , G4double value , const conditions::
   return false;
 }
 
-bool G4ShowerMap::Analysis::ParentMatches( int id , int& parentid , const conditions::conditionbase& cond ) {
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::Accumulate( int id , G4double delta , const conditions::conditionbase& cond ) {
+  if ( baseclass::IsConcurrent() ) {
+    AccumulateOp op( delta , cond );
+    return baseclass::ModifyConcurrent( id , op );
+  }
+  AccumulateOp op( delta , cond );
+  return baseclass::ModifyData( id , op );
+}
+
+template<class C>
+size_t G4ShowerMap::TAnalysis<C>::Accumulate( const std::vector<std::pair<int,G4double> >& deltas , const conditions::conditionbase& cond ) {
+  size_t accumulated = 0;
+  for ( std::vector<std::pair<int,G4double> >::const_iterator it = deltas.begin() ; it != deltas.end() ; ++it ) {
+    if ( Accumulate( it->first , it->second , cond ) ) ++accumulated;
+  }
+  return accumulated;
+}
+
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::ParentMatches( int id , int& parentid , const conditions::conditionbase& cond ) {
     if ( baseclass::Exists(id) ) {
       baseclass::Select(id);
       return baseclass::HasParent( parentid , cond ); //Not at all optimized, goes thought tree twice!
@@ -73,7 +130,8 @@ bool G4ShowerMap::Analysis::ParentMatches( int id , int& parentid , const condit
 }
 
 
-bool G4ShowerMap::Analysis::GetSumParents( int id , double& result, const G4ShowerMap::conditions::conditionbase& cond ) {
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::GetSumParents( int id , double& result, const G4ShowerMap::conditions::conditionbase& cond ) {
   if ( baseclass::Exists(id) ) {
     baseclass::Select(id);
     result = baseclass::SumParent( cond );
@@ -83,13 +141,14 @@ bool G4ShowerMap::Analysis::GetSumParents( int id , double& result, const G4Show
   return false;
 }
 
-bool G4ShowerMap::Analysis::GetSumSecondaries( int id , double& result , const G4ShowerMap::conditions::conditionbase& cond ) {
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::GetSumSecondaries( int id , double& result , const G4ShowerMap::conditions::conditionbase& cond ) {
   bool retval = false;
   if ( baseclass::Exists(id) ) {
     baseclass::Select(id);
     if ( baseclass::SelectFirstChild() ) {
       do { //Loop on secondaries
-	const baseclass::value_type& _data = baseclass::GetData();
+	const typename baseclass::value_type& _data = baseclass::GetData();
 	const bool selectme = cond(_data);
 	if ( selectme ) {
 	  retval = true;
@@ -101,16 +160,20 @@ bool G4ShowerMap::Analysis::GetSumSecondaries( int id , double& result , const G
   return retval;
 }
 
-std::pair<int,G4ShowerMap::Analysis::struct_type> G4ShowerMap::Analysis::GetInfo( const baseclass::map_type::const_iterator& it ) { 
+template<class C>
+std::pair<int,typename G4ShowerMap::TAnalysis<C>::struct_type> G4ShowerMap::TAnalysis<C>::GetInfo( const const_iterator& it ) { 
   return std::make_pair(it->first,baseclass::GetData(it) ); 
 }
 
-void G4ShowerMap::Analysis::AddSecondary( int id, int parent_id, G4ParticleDefinition* pd , G4double value ) {
-  baseclass::value_type node = {pd,value};
-  baseclass::AddOne( id , parent_id , node );
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::AddSecondary( int id, int parent_id, G4ParticleDefinition* pd , G4double value ) {
+  typename baseclass::value_type node = {pd,value};
+  if ( baseclass::IsConcurrent() ) return baseclass::AddOneConcurrent( id , parent_id , node );
+  return baseclass::AddOne( id , parent_id , node );
 }
 
-bool G4ShowerMap::Analysis::GetSecondariesIds( int id, std::vector<int>& result, const conditions::conditionbase& cond ) {
+template<class C>
+bool G4ShowerMap::TAnalysis<C>::GetSecondariesIds( int id, std::vector<int>& result, const conditions::conditionbase& cond ) {
   bool retval = false;
   if ( baseclass::Exists(id) ) {
     baseclass::Select(id);
@@ -124,3 +187,259 @@ bool G4ShowerMap::Analysis::GetSecondariesIds( int id, std::vector<int>& result,
   }
   return retval;
 }
+
+//The two storage backends
+template class G4ShowerMap::TAnalysis< G4ShowerMap::internal::Container<G4ShowerMap::G4TrackData<G4double>,int> >;
+template class G4ShowerMap::TAnalysis< G4ShowerMap::internal::CompactContainer<G4ShowerMap::G4TrackData<G4double>,int> >;
+
+namespace {
+  typedef G4ShowerMap::QueryBatch::Result Result;
+  //Queries of one type on one particle: pairs (condition index, query index)
+  typedef std::vector<std::pair<size_t,size_t> > Requests;
+
+  //Key used to sort the queries of a batch
+  struct QueryKey {
+    int id;
+    int type;
+    size_t cond;
+    size_t query;
+    bool operator<( const QueryKey& rhs ) const {
+      if ( id != rhs.id ) return id < rhs.id;
+      if ( type != rhs.type ) return type < rhs.type;
+      if ( cond != rhs.cond ) return cond < rhs.cond;
+      return query < rhs.query;
+    }
+  };
+
+  //Evaluates the queries of a QueryBatch::Run on a MAP (Analysis or CompactAnalysis),
+  //one particle at a time.
+  //Each method starts with the cursor on the particle; all but SumParents
+  //leave it there. Memoized sums are kept only for queried particles.
+  template<class MAP>
+  class BatchEvaluator {
+    typedef typename MAP::struct_type TrackData;
+  public:
+    BatchEvaluator( MAP& map , const std::vector<const G4ShowerMap::conditions::conditionbase*>& conds ,
+		    const std::vector<size_t>& branchConds , const std::vector<int>& branchRoots , std::vector<Result>& results ) :
+      m_map(map), m_conds(conds), m_branchConds(branchConds), m_branchRoots(branchRoots), m_results(results) {}
+
+    void Value( const Requests& requests ) {
+      const TrackData& _data = m_map.GetData();
+      for ( size_t r = 0 ; r < requests.size() ; ++r ) {
+	Result& result = m_results[requests[r].second];
+	result.found = (*m_conds[requests[r].first])( _data );
+	if ( result.found ) result.value = _data.data;
+      }
+    }
+
+    //One walk of the secondaries for all conditions
+    void SumSecondaries( const Requests& requests ) {
+      if ( ! m_map.HasFirstChild() ) return;
+      m_map.SelectFirstChild();
+      for (;;) {
+	const TrackData& _data = m_map.GetData();
+	for ( size_t r = 0 ; r < requests.size() ; ++r ) {
+	  if ( (*m_conds[requests[r].first])( _data ) ) {
+	    Result& result = m_results[requests[r].second];
+	    result.found = true;
+	    result.value += _data.data;
+	  }
+	}
+	if ( ! m_map.HasNextSibling() ) break;
+	m_map.SelectNextSibling();
+      }
+      m_map.SelectParent();
+    }
+
+    //One walk up for all conditions. The walk for a condition stops at the first
+    //parent with a memoized sum: the sum of its own parents is then known
+    void SumParents( const Requests& requests ) {
+      const int id = m_map.GetCurrentId();
+      size_t open = requests.size();
+      m_closed.assign( requests.size() , 0 );
+      while ( open > 0 && m_map.SelectParent() ) {
+	const TrackData& _data = m_map.GetData();
+	const int pid = m_map.GetCurrentId();
+	std::map<std::pair<int,size_t>,Result>::const_iterator memo = m_parents.lower_bound( std::make_pair(pid,size_t(0)) );
+	const bool hasMemo = memo != m_parents.end() && memo->first.first == pid;
+	for ( size_t r = 0 ; r < requests.size() ; ++r ) {
+	  if ( m_closed[r] ) continue;
+	  Result& result = m_results[requests[r].second];
+	  if ( (*m_conds[requests[r].first])( _data ) ) {
+	    result.found = true;
+	    result.value += _data.data;
+	  }
+	  if ( hasMemo ) {
+	    memo = m_parents.find( std::make_pair(pid,requests[r].first) );
+	    if ( memo != m_parents.end() ) {
+	      result.found = result.found || memo->second.found;
+	      result.value += memo->second.value;
+	      m_closed[r] = 1;
+	      --open;
+	    }
+	  }
+	}
+      }
+      for ( size_t r = 0 ; r < requests.size() ; ++r )
+	m_parents[ std::make_pair(id,requests[r].first) ] = m_results[requests[r].second];
+    }
+
+    //All conditions of branch queries are summed in the same visit
+    void SumBranch( const Requests& requests , const std::vector<size_t>& branchIndex ) {
+      std::map<int,std::vector<Result> >::const_iterator memo = m_branch.find( m_map.GetCurrentId() );
+      if ( memo == m_branch.end() ) {
+	Result empty = { false , 0. };
+	std::vector<Result> dummy( m_branchConds.size() , empty );
+	VisitBranch( dummy );
+	memo = m_branch.find( m_map.GetCurrentId() );
+      }
+      for ( size_t r = 0 ; r < requests.size() ; ++r )
+	m_results[requests[r].second] = memo->second[ branchIndex[requests[r].first] ];
+    }
+  private:
+    //Post-order visit of the branch of current node, sums are added to sums and the cursor
+    //is back on the node at the end. Sums of branches of queried particles are memoized:
+    //they are not visited again by other branch queries
+    void VisitBranch( std::vector<Result>& sums ) {
+      const int id = m_map.GetCurrentId();
+      std::map<int,std::vector<Result> >::const_iterator memo = m_branch.find(id);
+      if ( memo != m_branch.end() ) {
+	Accumulate( sums , memo->second );
+	return;
+      }
+      const bool isRoot = std::binary_search( m_branchRoots.begin() , m_branchRoots.end() , id );
+      Result empty = { false , 0. };
+      std::vector<Result> own;
+      if ( isRoot ) own.resize( m_branchConds.size() , empty );
+      std::vector<Result>& target = isRoot ? own : sums;
+      if ( m_map.HasFirstChild() ) {
+	m_map.SelectFirstChild();
+	for (;;) {
+	  VisitBranch( target );
+	  if ( ! m_map.HasNextSibling() ) break;
+	  m_map.SelectNextSibling();
+	}
+	m_map.SelectParent();
+      }
+      const TrackData& _data = m_map.GetData();
+      for ( size_t b = 0 ; b < m_branchConds.size() ; ++b ) {
+	if ( (*m_conds[m_branchConds[b]])( _data ) ) {
+	  target[b].found = true;
+	  target[b].value += _data.data;
+	}
+      }
+      if ( isRoot ) {
+	m_branch[id] = own;
+	Accumulate( sums , own );
+      }
+    }
+    static void Accumulate( std::vector<Result>& sums , const std::vector<Result>& other ) {
+      for ( size_t b = 0 ; b < sums.size() ; ++b ) {
+	sums[b].found = sums[b].found || other[b].found;
+	sums[b].value += other[b].value;
+      }
+    }
+
+    MAP& m_map;
+    const std::vector<const G4ShowerMap::conditions::conditionbase*>& m_conds;
+    const std::vector<size_t>& m_branchConds;
+    const std::vector<int>& m_branchRoots; //sorted
+    std::vector<Result>& m_results;
+    std::vector<char> m_closed;
+    std::map<std::pair<int,size_t>,Result> m_parents;
+    std::map<int,std::vector<Result> > m_branch;
+  };
+}
+
+size_t G4ShowerMap::QueryBatch::Add( QueryType type , int id , const conditions::conditionbase& cond ) {
+  size_t c = 0;
+  while ( c < m_conditions.size() && m_conditions[c] != &cond ) ++c;
+  if ( c == m_conditions.size() ) m_conditions.push_back( &cond );
+  Query query = { type , id , c };
+  m_queries.push_back( query );
+  return m_queries.size()-1;
+}
+
+size_t G4ShowerMap::QueryBatch::AddValue( int id , const conditions::conditionbase& cond ) {
+  return Add( kValue , id , cond );
+}
+
+size_t G4ShowerMap::QueryBatch::AddSumParents( int id , const conditions::conditionbase& cond ) {
+  return Add( kSumParents , id , cond );
+}
+
+size_t G4ShowerMap::QueryBatch::AddSumSecondaries( int id , const conditions::conditionbase& cond ) {
+  return Add( kSumSecondaries , id , cond );
+}
+
+size_t G4ShowerMap::QueryBatch::AddSumBranch( int id , const conditions::conditionbase& cond ) {
+  return Add( kSumBranch , id , cond );
+}
+
+void G4ShowerMap::QueryBatch::Clear() {
+  m_conditions.clear();
+  m_queries.clear();
+  m_results.clear();
+  m_elapsed = 0;
+}
+
+template<class MAP>
+void G4ShowerMap::QueryBatch::Run( MAP& map ) {
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const size_t n = m_queries.size();
+  Result empty = { false , 0. };
+  m_results.assign( n , empty );
+  //Group queries by particle and type. Particles are evaluated by increasing id:
+  //in Geant4 parents have smaller ids, so their memoized sums are found by secondaries
+  std::vector<QueryKey> keys( n );
+  for ( size_t q = 0 ; q < n ; ++q ) {
+    QueryKey key = { m_queries[q].id , m_queries[q].type , m_queries[q].cond , q };
+    keys[q] = key;
+  }
+  std::sort( keys.begin() , keys.end() );
+  //Conditions used by branch queries are evaluated together during the same visit
+  std::vector<size_t> branchIndex( m_conditions.size() , m_conditions.size() );
+  std::vector<size_t> branchConds;
+  std::vector<int> branchRoots;
+  for ( size_t q = 0 ; q < n ; ++q ) {
+    if ( keys[q].type != kSumBranch ) continue;
+    if ( branchRoots.empty() || branchRoots.back() != keys[q].id ) branchRoots.push_back( keys[q].id );
+    const size_t c = keys[q].cond;
+    if ( branchIndex[c] == m_conditions.size() ) {
+      branchIndex[c] = branchConds.size();
+      branchConds.push_back( c );
+    }
+  }
+  BatchEvaluator<MAP> evaluator( map , m_conditions , branchConds , branchRoots , m_results );
+  Requests requests;
+  size_t first = 0;
+  while ( first < n ) {
+    const int id = keys[first].id;
+    const int type = keys[first].type;
+    size_t last = first;
+    requests.clear();
+    for ( ; last < n && keys[last].id == id && keys[last].type == type ; ++last ) {
+      //Identical queries are evaluated once
+      if ( last == first || keys[last].cond != keys[last-1].cond )
+	requests.push_back( std::make_pair( keys[last].cond , keys[last].query ) );
+    }
+    if ( map.Exists(id) ) {
+      //One selection per particle: the cursor stays on it until SumParents
+      if ( first == 0 || keys[first-1].id != id ) map.Select(id);
+      switch ( type ) {
+      case kValue:          evaluator.Value( requests ); break;
+      case kSumBranch:      evaluator.SumBranch( requests , branchIndex ); break;
+      case kSumSecondaries: evaluator.SumSecondaries( requests ); break;
+      case kSumParents:     evaluator.SumParents( requests ); break;
+      }
+      for ( size_t q = first+1 ; q < last ; ++q ) {
+	if ( keys[q].cond == keys[q-1].cond ) m_results[keys[q].query] = m_results[keys[q-1].query];
+      }
+    }
+    first = last;
+  }
+  m_elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+template void G4ShowerMap::QueryBatch::Run( Analysis& map );
+template void G4ShowerMap::QueryBatch::Run( CompactAnalysis& map );
@@ -4,6 +4,7 @@
 #include <map>
 #include <ostream>
 #include <vector>
+#include <type_traits>
 
 //If this is defined, use "fake" internals of G4,
 //Used for testing w/o G4
@@ -13,21 +14,33 @@
 #  define G4double double
 #  define G4ThreadLocal
 #  define G4ParticleDefinition string 
+#  include <mutex>
+   typedef std::mutex G4Mutex;
+#  define G4MUTEXINIT(mutex)
+#  define G4MUTEXDESTROY(mutex)
+   struct G4AutoLock : public std::lock_guard<std::mutex> {
+     G4AutoLock( G4Mutex* m ) : std::lock_guard<std::mutex>(*m) {}
+   };
 #else  //UNITTESTING
 #  include "G4ParticleDefinition.hh"
+#  include "G4AutoLock.hh"
 #endif //UNITTESTING
 
 #include "G4ShowerMapInternals.hh"
 
 // Three entities are defined in this namespace:
 // G4TrackData<T>     template class containing information about a specific particle
-// TShowerMap<T>      container of G4TrackData<T> instances. User should not use directly
+// TShowerMap<T,C>    container of G4TrackData<T> instances. User should not use directly
 //                    this class, but instead the derived class that implements higher level
 //                    utilities and methods.
 //                    Requirement for T is to implement a meaning default constructor and 
 //                    support the increament operator += (e.g. T=G4double)
+//                    C is the storage: internal::Container (std::map of nodes, default) or
+//                    internal::CompactContainer (contiguous array of 24 bytes nodes)
 // conditions::ptype  functor to select particles based on their species
 // Analysis           concrete implementation of a TShiowerMap<G4double>
+// CompactAnalysis    same as Analysis with compact storage. Track ids must be positive
+//                    and dense. It has no concurrent mode (BeginConcurrent/EndConcurrent)
 
 namespace G4ShowerMap { 
 
@@ -48,14 +61,31 @@ namespace G4ShowerMap {
     return os;
   }
 
+  namespace internal {
+    //G4TrackData is stored in a CompactContainer as a code for the particle definition
+    //and the data
+    template<class T>
+    struct CompactTraits< G4TrackData<T> > {
+      typedef G4ParticleDefinition* key_type;
+      typedef T payload_type;
+      static key_type Key( const G4TrackData<T>& d ) { return d.pdef; }
+      static const payload_type& Payload( const G4TrackData<T>& d ) { return d.data; }
+      static G4TrackData<T> Make( const key_type& pdef , const payload_type& data ) {
+	G4TrackData<T> d = { pdef , data };
+	return d;
+      }
+    };
+  }
+
   //Base template class that builds a map of a quantity of type T
   //associatying a particle definition
   //Note that user should use concrete class (see later)
   //  There are two requirements on T: it should have a meaningful 
   //  default constructor T() and it should implement the  T& operator+=(const T&)
-  template<class T>
-  class TShowerMap : public internal::Container<G4TrackData<T>,int> {
-    typedef internal::Container<G4TrackData<T>,int> baseclass;
+  //  C is the container used to store the particles
+  template<class T, class C = internal::Container<G4TrackData<T>,int> >
+  class TShowerMap : public C {
+    typedef C baseclass;
   public:
     typedef conditions::basecondition<G4TrackData<T> > conditionbase;
     typedef conditions::dummy<G4TrackData<T> > alwaysTrue;
@@ -164,8 +194,8 @@ namespace G4ShowerMap {
     TShowerMap() {}
   private:
     //disable copy constructor and assignement operators
-    TShowerMap(const TShowerMap<T>& rhs);
-    TShowerMap<T>& operator=(const TShowerMap<T>& rhs);
+    TShowerMap(const TShowerMap<T,C>& rhs);
+    TShowerMap<T,C>& operator=(const TShowerMap<T,C>& rhs);
   };
 
   //A functor to select particles based on 
@@ -187,17 +217,38 @@ namespace G4ShowerMap {
   //Concrete class implementing singleton pattern and using a G4double
   //to store the quantity
   //Here higher level methods are defined to help in selecting 
-  class Analysis : public TShowerMap<G4double> {
-    typedef TShowerMap<G4double> baseclass;
+  //C is the container, see Analysis and CompactAnalysis below
+  template<class C>
+  class TAnalysis : public TShowerMap<G4double,C> {
+    typedef TShowerMap<G4double,C> baseclass;
   public:
-    typedef baseclass::value_type struct_type; //G4TrackData<G4double>
-    static Analysis* Instance();
+    typedef typename baseclass::value_type struct_type; //G4TrackData<G4double>
+    static TAnalysis* Instance();
+    //Instance shared among all threads, to be used with BeginConcurrent()/EndConcurrent()
+    //when secondaries of the same event are tracked by several threads.
+    //Only available if the container has a concurrent mode (not for CompactAnalysis)
+    template<class CC = C>
+    static typename std::enable_if<CC::ConcurrentMode,TAnalysis*>::type SharedInstance() {
+      static TAnalysis* analysis = new TAnalysis;
+      return analysis;
+    }
     //Clear map content.
     void Clear() { baseclass::Clear(); }
     //Add a secondary. If parent_id is zero, this is a primary
-    void AddSecondary( int id , int parent_id , G4ParticleDefinition* pd , G4double value );
+    //Returns false if the particle cannot be stored (see CompactContainer::AddOne)
+    //Thread-safe between BeginConcurrent() and EndConcurrent()
+    bool AddSecondary( int id , int parent_id , G4ParticleDefinition* pd , G4double value );
     //Update values of a particle with given id
+    //Thread-safe between BeginConcurrent() and EndConcurrent()
     bool Update( int id , G4double value , const conditions::conditionbase& cond = forceaccept() );
+    //Add delta to the value of a particle with given id. Meant to be used at each step:
+    //the map is looked up once, and not at all if the previous call was for the same id
+    //(the compact container needs no look up).
+    //Does not change the current selection.
+    //Thread-safe between BeginConcurrent() and EndConcurrent()
+    bool Accumulate( int id , G4double delta , const conditions::conditionbase& cond = forceaccept() );
+    //Same as above for several (id,delta) pairs, returns the number of pairs accumulated
+    size_t Accumulate( const std::vector<std::pair<int,G4double> >& deltas , const conditions::conditionbase& cond = forceaccept() );
 
     //All these methods return true if and condition is met, otherwise false. If id does not 
     //exist also return false
@@ -220,15 +271,85 @@ namespace G4ShowerMap {
     bool GetHeads(  std::vector<int>& result , const conditions::conditionbase& cond );
 
     //Returns iterator to first element
-    typedef  baseclass::map_type::const_iterator const_iterator;
-    const_iterator First() const { return m_map.begin(); }
+    typedef typename baseclass::const_iterator const_iterator;
+    const_iterator First() const { return baseclass::Begin(); }
     //Returns iterator to past-last element
-    const_iterator End() const { return m_map.end(); }
+    const_iterator End() const { return baseclass::End(); }
     //Returns a pair with id and G4TrackData structure for the current iterator.
     static std::pair<int,struct_type > GetInfo( const const_iterator& it );
-    size_t Size() const { return m_map.size(); }
     
   };
+
+  //Analysis storing particles in a std::map of nodes (about 100 bytes per particle)
+  typedef TAnalysis< internal::Container<G4TrackData<G4double>,int> > Analysis;
+  //Analysis storing particles in a contiguous array indexed by track id (24 bytes per
+  //particle): links between particles are 32-bit indices and the particle definition
+  //is a 16-bit code. Track ids must be positive and dense (as Geant4 track ids are),
+  //since memory is proportional to the largest id (ids above GetMaxId() are ignored).
+  //It has no concurrent mode.
+  typedef TAnalysis< internal::CompactContainer<G4TrackData<G4double>,int> > CompactAnalysis;
+
+  //A batch of queries evaluated together on a (frozen) Analysis or CompactAnalysis.
+  //Queries are registered up front, Run executes all of them sharing traversals:
+  //queries on the same particle are grouped (one selection, one walk of the
+  //secondaries or of the parents for all conditions), identical queries are
+  //evaluated once, all branch sums are computed in the same visit and sums of
+  //parents and of branches of queried particles are memoized and reused.
+  //Conditions are not cached per particle: a particle met by different walks
+  //(or by the walks of parents of two unrelated particles) is evaluated again.
+  //Conditions are kept by reference and must be valid when Run is called.
+  class QueryBatch {
+  public:
+    //Each result has a value and a flag that is true if at least one
+    //node matched the condition (same as the return value of Analysis methods)
+    struct Result {
+      bool found;
+      G4double value;
+    };
+    QueryBatch() : m_elapsed(0) {}
+    //Register a query, returns the index of its result.
+    //Equivalent of Analysis::GetValue
+    size_t AddValue( int id , const conditions::conditionbase& cond );
+    size_t AddValue( int id ) { return AddValue( id , m_accept ); }
+    //Equivalent of Analysis::GetSumParents
+    size_t AddSumParents( int id , const conditions::conditionbase& cond );
+    size_t AddSumParents( int id ) { return AddSumParents( id , m_accept ); }
+    //Equivalent of Analysis::GetSumSecondaries
+    size_t AddSumSecondaries( int id , const conditions::conditionbase& cond );
+    size_t AddSumSecondaries( int id ) { return AddSumSecondaries( id , m_accept ); }
+    //Equivalent of TShowerMap::SumBranch on the particle with given id
+    size_t AddSumBranch( int id , const conditions::conditionbase& cond );
+    size_t AddSumBranch( int id ) { return AddSumBranch( id , m_accept ); }
+    //Remove all queries and results
+    void Clear();
+
+    //Evaluate all queries, the cursor of map is left undefined.
+    //MAP is Analysis or CompactAnalysis
+    template<class MAP>
+    void Run( MAP& map );
+    const Result& GetResult( size_t query ) const { return m_results[query]; }
+    const std::vector<Result>& GetResults() const { return m_results; }
+    //Wall-clock time (in seconds) spent in last Run
+    double GetElapsed() const { return m_elapsed; }
+    size_t Size() const { return m_queries.size(); }
+  private:
+    //Order of evaluation of queries on the same particle
+    enum QueryType { kValue , kSumBranch , kSumSecondaries , kSumParents };
+    struct Query {
+      QueryType type;
+      int id;
+      size_t cond; //index in m_conditions
+    };
+    size_t Add( QueryType type , int id , const conditions::conditionbase& cond );
+    forceaccept m_accept;
+    std::vector<const conditions::conditionbase*> m_conditions;
+    std::vector<Query> m_queries;
+    std::vector<Result> m_results;
+    double m_elapsed;
+    //disable copy constructor and assignement operators (m_accept is referenced)
+    QueryBatch(const QueryBatch& rhs);
+    QueryBatch& operator=(const QueryBatch& rhs);
+  };
   
 } //End G4ShowerMap namespace
 
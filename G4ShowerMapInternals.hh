@@ -3,6 +3,8 @@
 
 #include <map>
 #include <ostream>
+#include <vector>
+#include <stdint.h>
 
 //Namespace for G4 application use
 namespace G4ShowerMap { 
@@ -44,20 +46,18 @@ namespace G4ShowerMap {
       }
     private:
       // Constructors
-      Node () : p_parent(0), p_firstChild(0) , p_nextSibling(0) {}
-      Node (ID id , T data) : m_id(id), m_data(data), p_parent(0), p_firstChild(0) , p_nextSibling(0) { }
-      Node (ID id , T data, Node<T,ID>* parent) : m_id(id) , m_data(data), p_parent(parent), p_firstChild(0) , p_nextSibling(0) {
-	if ( p_parent->p_firstChild == 0 ) { p_parent->p_firstChild = this; }
-	else {
-	  Node<T,ID>* next = p_parent->p_firstChild;
-	  do { 
-	    if ( next->p_nextSibling == 0 ) { 
-	      next->p_nextSibling = this;
-	      break;
-	    }
-	    next = next->p_nextSibling;
-	  } while(next);
-	}
+      Node () : p_parent(0), p_firstChild(0) , p_lastChild(0), p_nextSibling(0) {}
+      Node (ID id , T data) : m_id(id), m_data(data), p_parent(0), p_firstChild(0) , p_lastChild(0), p_nextSibling(0) { }
+      Node (ID id , T data, Node<T,ID>* parent) : m_id(id) , m_data(data), p_parent(0), p_firstChild(0) , p_lastChild(0), p_nextSibling(0) {
+	LinkToParent(parent);
+      }
+
+      //Append this node at the end of the list of children of parent
+      void LinkToParent( Node<T,ID>* parent ) {
+	p_parent = parent;
+	if ( p_parent->p_lastChild == 0 ) { p_parent->p_firstChild = this; }
+	else { p_parent->p_lastChild->p_nextSibling = this; }
+	p_parent->p_lastChild = this;
       }
       
       //Data
@@ -65,6 +65,7 @@ namespace G4ShowerMap {
       T m_data;
       Node<T,ID>* p_parent;
       Node<T,ID>* p_firstChild;
+      Node<T,ID>* p_lastChild; //To append children without walking the list
       Node<T,ID>* p_nextSibling;
       
       //Disable copy and assignement
@@ -88,9 +89,17 @@ namespace G4ShowerMap {
       typedef std::map<ID,Node<T,ID>* > map_type;
       typedef typename Node<T,ID>::value_type value_type;
       typedef typename Node<T,ID>::id_type id_type;
+
+      static const bool ConcurrentMode = true;
+
+      Container() : p_current(0), p_last(0), m_concurrent(false) {
+	for ( unsigned int i = 0 ; i < NumShards ; ++i ) { G4MUTEXINIT( m_shards[i].mutex ); }
+      }
       
       //Manipulate container
-      void AddOne( id_type id , id_type parent , const value_type& data ) {
+      //Always succeeds, returns true for interface compatibility with CompactContainer
+      bool AddOne( id_type id , id_type parent , const value_type& data ) {
+	p_last = 0;
 	typename map_type::const_iterator parentIt = m_map.find(parent);
 	if ( parentIt != m_map.end() ) { 
 	  m_map[id] = new Node<T,ID>(id,data,parentIt->second);
@@ -98,9 +107,11 @@ namespace G4ShowerMap {
 	else {
 	  m_map[id] = new Node<T,ID>(id,data);
 	}
+	return true;
       }
       //Empty container and delete nodes
       void Clear() { 
+	p_last = 0;
 	typename map_type::iterator it = m_map.begin();
 	while ( it!=m_map.end() ) {
 	  Node<T,ID>* e = it->second;
@@ -108,8 +119,16 @@ namespace G4ShowerMap {
 	  delete e;
 	  it = m_map.begin();
 	}
+	for ( unsigned int i = 0 ; i < NumShards ; ++i ) {
+	  map_type& shard = m_shards[i].map;
+	  for ( it = shard.begin() ; it != shard.end() ; ++it ) delete it->second;
+	  shard.clear();
+	}
+      }
+      virtual ~Container() { 
+	Clear();
+	for ( unsigned int i = 0 ; i < NumShards ; ++i ) { G4MUTEXDESTROY( m_shards[i].mutex ); }
       }
-      virtual ~Container() { Clear(); }
       
       //Analyse container
       bool Exists( const id_type& id ) const { return (m_map.find(id) != m_map.end()); }
@@ -119,12 +138,322 @@ namespace G4ShowerMap {
       bool SelectParent() { return p_current = p_current->p_parent; }
       bool SelectFirstChild() { return p_current = p_current->p_firstChild; }
       bool SelectNextSibling() { return p_current = p_current->p_nextSibling; }
+      bool HasFirstChild() const { return p_current->p_firstChild != 0; }
+      bool HasNextSibling() const { return p_current->p_nextSibling != 0; }
       bool CurrentValid() const { return (p_current != 0); }
       void UpdateCurrentValue( const value_type& newval ) { p_current->m_data = newval; }
+      //Data of node id, 0 if it does not exist. Does not change the current selection.
+      //The last node found is cached: consecutive calls with the same id do not look up the map
+      value_type* FindData( const id_type& id ) {
+	if ( p_last == 0 || p_last->m_id != id ) {
+	  typename map_type::const_iterator it = m_map.find(id);
+	  if ( it == m_map.end() ) return 0;
+	  p_last = it->second;
+	}
+	return &p_last->m_data;
+      }
+      //Calls op(value_type&) on data of node id, found with FindData.
+      //Returns false if id does not exist, otherwise the value returned by op
+      template <class OP>
+      bool ModifyData( const id_type& id , OP& op ) {
+	value_type* _data = FindData( id );
+	return _data ? op(*_data) : false;
+      }
+      size_t Size() const { return m_map.size(); }
+      //Nothing to reserve in a map, for interface compatibility with CompactContainer
+      void Reserve( id_type ) {}
+      typedef typename map_type::const_iterator const_iterator;
+      const_iterator Begin() const { return m_map.begin(); }
+      const_iterator End() const { return m_map.end(); }
+
+      //Concurrent insertion.
+      //Between BeginConcurrent() and EndConcurrent() AddOneConcurrent and ModifyConcurrent
+      //can be called at the same time from several threads. New nodes are indexed in
+      //one of NumShards sub-maps, each protected by its own mutex and chosen from the node id,
+      //so threads working on different tracks rarely wait for each other.
+      //Data of a node is modified only holding the lock of its shard, the list of children
+      //of a node is modified only holding the lock of the shard of the parent.
+      //Appending a child is O(1), so a parent with many secondaries holds its lock only briefly.
+      //EndConcurrent() is the barrier point: it must be called by a single thread and moves
+      //all shards into the main map. Navigation (Select, SelectParent, ...) and AddOne are
+      //not thread-safe and should only be used outside of the concurrent phase.
+      //The concurrent flag is a plain bool read by all threads: BeginConcurrent() must happen
+      //before the worker threads start inserting (e.g. before tasks are spawned), and
+      //EndConcurrent() after all of them have finished (e.g. after joining or a barrier).
+      void BeginConcurrent() { m_concurrent = true; }
+      bool IsConcurrent() const { return m_concurrent; }
+      bool AddOneConcurrent( id_type id , id_type parent , const value_type& data ) {
+	Node<T,ID>* node = new Node<T,ID>(id,data);
+	{
+	  Shard& shard = m_shards[ShardOf(id)];
+	  G4AutoLock lock(&shard.mutex);
+	  shard.map[id] = node;
+	}
+	Shard& pshard = m_shards[ShardOf(parent)];
+	G4AutoLock lock(&pshard.mutex);
+	Node<T,ID>* pnode = FindConcurrent( parent );
+	if ( pnode ) node->LinkToParent( pnode );
+	return true;
+      }
+      //Calls op(value_type&) on data of node id, with the lock of its shard held.
+      //Returns false if id does not exist, otherwise the value returned by op
+      template <class OP>
+      bool ModifyConcurrent( const id_type& id , OP& op ) {
+	Shard& shard = m_shards[ShardOf(id)];
+	G4AutoLock lock(&shard.mutex);
+	Node<T,ID>* node = FindConcurrent( id );
+	return node ? op(node->m_data) : false;
+      }
+      void EndConcurrent() {
+	for ( unsigned int i = 0 ; i < NumShards ; ++i ) {
+	  map_type& shard = m_shards[i].map;
+	  for ( typename map_type::const_iterator it = shard.begin() ; it != shard.end() ; ++it )
+	    m_map[it->first] = it->second;
+	  shard.clear();
+	}
+	m_concurrent = false;
+	p_last = 0;
+      }
     protected:
       static T GetData( const typename map_type::const_iterator& it ) { return it->second->m_data; }
       std::map<ID,Node<T,ID>* > m_map;
       Node<T,ID>* p_current;
+    private:
+      Node<T,ID>* p_last; //Cache of FindData
+      static const unsigned int NumShards = 64;
+      struct Shard {
+	G4Mutex mutex;
+	map_type map;
+      };
+      static unsigned int ShardOf( const id_type& id ) { return static_cast<unsigned long>(id) % NumShards; }
+      //Caller must hold the lock of the shard of id. Nodes added before the concurrent
+      //phase are in the main map, that is not modified during the concurrent phase
+      Node<T,ID>* FindConcurrent( const id_type& id ) const {
+	const map_type& shard = m_shards[ShardOf(id)].map;
+	typename map_type::const_iterator it = shard.find(id);
+	if ( it != shard.end() ) return it->second;
+	it = m_map.find(id);
+	return it != m_map.end() ? it->second : 0;
+      }
+      Shard m_shards[NumShards];
+      bool m_concurrent;
+    };
+
+    /*Traits used by CompactContainer to store a value of type T as a small code
+      and a payload. To be specialized for each T, providing:
+        typedef ... key_type;     //few distinct values (e.g. particle definitions)
+        typedef ... payload_type; //stored in the node
+        static key_type Key( const T& );
+        static const payload_type& Payload( const T& );
+        static T Make( const key_type& , const payload_type& ); */
+    template <class T> struct CompactTraits;
+
+    /*A compact Node: same relations as Node, but parent, children and next sibling
+      are 32-bit indices in the contiguous array of nodes of a CompactContainer, and the
+      index is the ID itself. Index 0 is never used and plays the role of NULL.
+      A node refers to its last child, and the next sibling of the last child is the
+      first child: children form a circular list, so that a child is appended in O(1)
+      without an additional index.
+      The key of the value (e.g. the particle species) is stored as a 16-bit code.
+      For a double payload the size of a node is 24 bytes. */
+    template <class P>
+    struct CompactNode {
+      static const uint32_t Absent = 0xFFFFFFFF; //Value of m_parent for unused indices
+      CompactNode() : m_parent(Absent), m_lastChild(0), m_nextSibling(0), m_code(0), m_data() {}
+      uint32_t m_parent;
+      uint32_t m_lastChild;
+      uint32_t m_nextSibling;
+      uint16_t m_code;
+      P m_data;
+    };
+
+    /* Compact container class
+       Same interface as Container, nodes are stored in a contiguous array indexed by ID.
+       Values are split by CompactTraits<T> in a key, replaced by a code, and a payload.
+       GetData() returns values by copy.
+       IDs must be positive and are expected to be dense, as Geant4 track IDs are: memory
+       is 24 bytes times the largest ID. IDs larger than GetMaxId() are rejected, as well
+       as values with more than MaxKeys different keys.
+       There is no concurrent mode: IsConcurrent() is always false.
+     */
+    template <class T, class ID=int>
+    class CompactContainer {
+      friend std::ostream& operator<<(std::ostream& os , const CompactContainer<T,ID>& ct) {
+	for ( const_iterator it = ct.Begin() ; it != ct.End() ; ++it ) {
+	  const CompactNode<payload_type>& e = *(it->second);
+	  os << "id: "<<it->first<<" = "<<GetData(it)
+	     << " ; parent id: "<<e.m_parent
+	     << " ; First Child id: "<<ct.FirstChildOf(it->first)
+	     << " ; Next Sibling id: "<<ct.NextSiblingOf(it->first)<<"\n";
+	}
+	return os;
+      }
+    public:
+      typedef CompactTraits<T> traits;
+      typedef typename traits::key_type key_type;
+      typedef typename traits::payload_type payload_type;
+      typedef T value_type;
+      typedef ID id_type;
+      typedef uint16_t code_type;
+      static const bool ConcurrentMode = false;
+      static const size_t MaxKeys = 65536;
+
+      //Iterator over existing nodes, it->first is the ID
+      class const_iterator {
+      public:
+	typedef std::pair<ID,const CompactNode<payload_type>*> pair_type;
+	const_iterator() : p_container(0), m_index(0), m_value(0,0) {}
+	const pair_type& operator*() const { return m_value; }
+	const pair_type* operator->() const { return &m_value; }
+	const_iterator& operator++() {
+	  do { ++m_index; } while ( m_index < p_container->m_nodes.size() && ! p_container->ExistsIndex(m_index) );
+	  Set();
+	  return *this;
+	}
+	const_iterator& operator--() {
+	  if ( m_index == 0 ) return *this;
+	  do { --m_index; } while ( m_index > 0 && ! p_container->ExistsIndex(m_index) );
+	  Set();
+	  return *this;
+	}
+	bool operator==( const const_iterator& rhs ) const { return m_index == rhs.m_index; }
+	bool operator!=( const const_iterator& rhs ) const { return m_index != rhs.m_index; }
+      private:
+	friend class CompactContainer<T,ID>;
+	const_iterator( const CompactContainer<T,ID>* ct , uint32_t index ) : p_container(ct), m_index(index), m_value(0,0) { Set(); }
+	void Set() {
+	  m_value.first = static_cast<ID>(m_index);
+	  m_value.second = m_index < p_container->m_nodes.size() ? &p_container->m_nodes[m_index] : 0;
+	}
+	const CompactContainer<T,ID>* p_container;
+	uint32_t m_index;
+	pair_type m_value;
+      };
+
+      CompactContainer() : m_nodes(1), m_current(0), m_size(0), m_maxId(1<<26) {}
+      virtual ~CompactContainer() {}
+
+      //Manipulate container
+      //Returns false, and the node is not added, if id is not positive or larger than
+      //GetMaxId(), or if the key of data would be the MaxKeys+1-th different key.
+      //If id already exists only its value is replaced.
+      //If parent does not exist (or is id itself) the node is a root
+      bool AddOne( id_type id , id_type parent , const value_type& data ) {
+	if ( id <= 0 || id > m_maxId ) return false;
+	code_type code = 0;
+	if ( ! Code( traits::Key(data) , code ) ) return false;
+	const bool hasParent = Exists(parent); //Before adding id, in case parent==id
+	const uint32_t idx = static_cast<uint32_t>(id);
+	if ( idx >= m_nodes.size() ) m_nodes.resize( idx+1 );
+	CompactNode<payload_type>& node = m_nodes[idx];
+	node.m_code = code;
+	node.m_data = traits::Payload(data);
+	if ( node.m_parent != CompactNode<payload_type>::Absent ) return true;
+	++m_size;
+	node.m_parent = 0;
+	if ( ! hasParent ) return true;
+	const uint32_t pidx = static_cast<uint32_t>(parent);
+	node.m_parent = pidx;
+	const uint32_t last = m_nodes[pidx].m_lastChild;
+	if ( last ) {
+	  node.m_nextSibling = m_nodes[last].m_nextSibling;
+	  m_nodes[last].m_nextSibling = idx;
+	}
+	else node.m_nextSibling = idx;
+	m_nodes[pidx].m_lastChild = idx;
+	return true;
+      }
+      //Empty container, memory is kept to be reused
+      void Clear() { 
+	m_nodes.clear();
+	m_nodes.resize(1);
+	m_current = 0;
+	m_size = 0;
+      }
+      //Reserve memory for IDs up to maxid
+      void Reserve( id_type maxid ) { if ( maxid > 0 && maxid <= m_maxId ) m_nodes.reserve( static_cast<uint32_t>(maxid)+1 ); }
+      //Largest accepted ID, limits the memory a single wrong ID can allocate
+      id_type GetMaxId() const { return m_maxId; }
+      void SetMaxId( id_type maxid ) { m_maxId = maxid; }
+      size_t Size() const { return m_size; }
+      //Memory used by nodes, in bytes
+      size_t Capacity() const { return m_nodes.capacity()*sizeof(CompactNode<payload_type>); }
+      const_iterator Begin() const { return ++const_iterator(this,0); }
+      const_iterator End() const { return const_iterator(this,static_cast<uint32_t>(m_nodes.size())); }
+
+      //Analyse container
+      bool Exists( const id_type& id ) const { return id > 0 && ExistsIndex( static_cast<uint32_t>(id) ); }
+      void Select( const id_type& id ) { m_current = static_cast<uint32_t>(id); }
+      value_type GetData() const { return Make( m_nodes[m_current] ); }
+      id_type GetCurrentId() const { return static_cast<id_type>(m_current); }
+      bool SelectParent() { return (m_current = m_nodes[m_current].m_parent) != 0; }
+      bool SelectFirstChild() { return (m_current = FirstChildOf(m_current)) != 0; }
+      bool SelectNextSibling() { return (m_current = NextSiblingOf(m_current)) != 0; }
+      bool HasFirstChild() const { return m_nodes[m_current].m_lastChild != 0; }
+      bool HasNextSibling() const { return NextSiblingOf(m_current) != 0; }
+      bool CurrentValid() const { return (m_current != 0); }
+      //The value is not changed if its key would be the MaxKeys+1-th different key
+      void UpdateCurrentValue( const value_type& newval ) { Store( m_nodes[m_current] , newval ); }
+      //Calls op(value_type&) on the value of node id and stores it back.
+      //Returns false if id does not exist or the value cannot be stored (see
+      //UpdateCurrentValue), otherwise the value returned by op.
+      //Does not change the current selection
+      template <class OP>
+      bool ModifyData( const id_type& id , OP& op ) {
+	if ( ! Exists(id) ) return false;
+	CompactNode<payload_type>& node = m_nodes[id];
+	value_type _data = Make( node );
+	const bool result = op( _data );
+	return Store( node , _data ) && result;
+      }
+
+      //No concurrent mode, these are equivalent to AddOne and ModifyData
+      bool IsConcurrent() const { return false; }
+      bool AddOneConcurrent( id_type id , id_type parent , const value_type& data ) { return AddOne( id , parent , data ); }
+      template <class OP>
+      bool ModifyConcurrent( const id_type& id , OP& op ) { return ModifyData( id , op ); }
+    protected:
+      static value_type GetData( const const_iterator& it ) { return it.p_container->Make( *(it->second) ); }
+      std::vector<CompactNode<payload_type> > m_nodes;
+      uint32_t m_current;
+      size_t m_size;
+    private:
+      bool ExistsIndex( uint32_t idx ) const { return idx < m_nodes.size() && m_nodes[idx].m_parent != CompactNode<payload_type>::Absent; }
+      //Children are a circular list starting after the last child
+      uint32_t FirstChildOf( uint32_t idx ) const {
+	const uint32_t last = m_nodes[idx].m_lastChild;
+	return last ? m_nodes[last].m_nextSibling : 0;
+      }
+      uint32_t NextSiblingOf( uint32_t idx ) const {
+	const CompactNode<payload_type>& node = m_nodes[idx];
+	return m_nodes[node.m_parent].m_lastChild == idx ? 0 : node.m_nextSibling;
+      }
+      value_type Make( const CompactNode<payload_type>& node ) const { return traits::Make( m_keys[node.m_code] , node.m_data ); }
+      //The key is encoded only if it changed (e.g. not when accumulating on the payload)
+      bool Store( CompactNode<payload_type>& node , const value_type& data ) {
+	const key_type& key = traits::Key(data);
+	if ( ! ( m_keys[node.m_code] == key ) ) {
+	  code_type code = 0;
+	  if ( ! Code( key , code ) ) return false;
+	  node.m_code = code;
+	}
+	node.m_data = traits::Payload(data);
+	return true;
+      }
+      //Code of a key, new codes are assigned when needed.
+      //Returns false if all MaxKeys codes are used by other keys
+      bool Code( const key_type& key , code_type& code ) {
+	typename std::map<key_type,code_type>::const_iterator it = m_codes.find( key );
+	if ( it != m_codes.end() ) { code = it->second; return true; }
+	if ( m_keys.size() >= MaxKeys ) return false;
+	code = static_cast<code_type>( m_keys.size() );
+	m_keys.push_back( key );
+	m_codes[key] = code;
+	return true;
+      }
+      std::vector<key_type> m_keys;
+      std::map<key_type,code_type> m_codes;
+      id_type m_maxId;
     };
 
   } // End namespace internal
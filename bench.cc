@@ -0,0 +1,172 @@
+//Benchmarks of G4ShowerMap.
+//Memory: compares the memory used by Analysis (std::map of Node pointers)
+//and CompactAnalysis (contiguous array of compact nodes) for a shower of
+//10^6 particles. Memory is measured counting the bytes requested to
+//operator new, overhead of the allocator itself is not included.
+//Delta rays: time to add 10^5 secondaries of the same particle.
+//Queries: time of a batch of queries evaluated with QueryBatch compared to
+//the same queries done one by one with Analysis methods.
+//Concurrency: time to fill the shared map in concurrent mode with
+//1 to 16 threads. Times only scale if the machine has enough cores.
+
+#ifndef UNITTESTING
+#error Recompile with -DUNITTESTING option
+#endif
+
+#include <iostream>
+#include <cstdlib>
+#include <new>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include "G4ShowerMap.hh"
+
+namespace {
+  std::atomic<size_t> allocated(0);
+  G4ParticleDefinition species[] = { "e-" , "e+" , "gamma" , "p" , "n" , "pi+" , "pi-" };
+  const int nSpecies = sizeof(species)/sizeof(species[0]);
+  const int nTracks = 1000000;
+}
+
+//Count all allocations, the size is stored in front of the block
+void* operator new( size_t size ) {
+  size_t* p = static_cast<size_t*>( std::malloc( size+sizeof(size_t) ) );
+  if ( p == 0 ) throw std::bad_alloc();
+  *p = size;
+  allocated += size;
+  return p+1;
+}
+void operator delete( void* ptr ) noexcept {
+  if ( ptr == 0 ) return;
+  size_t* p = static_cast<size_t*>(ptr)-1;
+  allocated -= *p;
+  std::free( p );
+}
+void operator delete( void* ptr , size_t ) noexcept { operator delete( ptr ); }
+
+//Fill a shower where each particle has up to 3 secondaries,
+//memory is counted from the value before
+template <class MAP>
+void Fill( MAP& map , const char* name , size_t before ) {
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for ( int id = 1 ; id <= nTracks ; ++id ) {
+    map.AddSecondary( id , id/3 , &species[id%nSpecies] , 0.001*id );
+  }
+  const double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  double sum = 0;
+  map.GetSumSecondaries( 1 , sum );
+  std::cout<<name<<": "<<map.Size()<<" particles, "
+	   <<double(allocated-before)/nTracks<<" bytes/particle, "
+	   <<"filled in "<<elapsed<<" s"<<std::endl;
+}
+
+//Many secondaries of one particle (e.g. delta rays of a primary)
+template <class MAP>
+void DeltaRays( MAP& map , const char* name ) {
+  const int nDeltas = 100000;
+  map.Clear();
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  map.AddSecondary( 1 , 0 , &species[3] , 0. );
+  for ( int id = 2 ; id <= nDeltas+1 ; ++id ) map.AddSecondary( id , 1 , &species[0] , 0.001 );
+  const double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  std::cout<<name<<": "<<nDeltas<<" secondaries of one particle added in "<<elapsed<<" s"<<std::endl;
+  map.Clear();
+}
+
+//Several hundreds queries of all types with three conditions on a shower
+//of 10^6 particles: QueryBatch::Run against the single methods
+void Queries( G4ShowerMap::Analysis& map ) {
+  G4ShowerMap::forceaccept all;
+  G4ShowerMap::conditions::ptype electrons( &species[0] );
+  G4ShowerMap::conditions::ptype gammas( &species[2] );
+  const G4ShowerMap::conditions::conditionbase* conds[] = { &all , &electrons , &gammas };
+  std::vector<int> ids, branchIds;
+  for ( int k = 0 ; k < 300 ; ++k ) ids.push_back( 1 + k*3331 );
+  branchIds.push_back( 1 );
+  for ( int k = 0 ; k < 20 ; ++k ) branchIds.push_back( 3000 + k*7 );
+
+  G4ShowerMap::QueryBatch batch;
+  for ( int c = 0 ; c < 3 ; ++c ) {
+    for ( size_t i = 0 ; i < ids.size() ; ++i ) {
+      batch.AddValue( ids[i] , *conds[c] );
+      batch.AddSumParents( ids[i] , *conds[c] );
+      batch.AddSumSecondaries( ids[i] , *conds[c] );
+    }
+    for ( size_t i = 0 ; i < branchIds.size() ; ++i ) batch.AddSumBranch( branchIds[i] , *conds[c] );
+  }
+  batch.Run( map );
+
+  double check = 0;
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for ( int c = 0 ; c < 3 ; ++c ) {
+    for ( size_t i = 0 ; i < ids.size() ; ++i ) {
+      double value = 0;
+      map.GetValue( ids[i] , value , *conds[c] );
+      check += value;
+      value = 0;
+      map.GetSumParents( ids[i] , value , *conds[c] );
+      check += value;
+      value = 0;
+      map.GetSumSecondaries( ids[i] , value , *conds[c] );
+      check += value;
+    }
+    for ( size_t i = 0 ; i < branchIds.size() ; ++i ) {
+      map.Select( branchIds[i] );
+      check += map.SumBranch( *conds[c] );
+    }
+  }
+  const double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  double batchCheck = 0;
+  for ( size_t q = 0 ; q < batch.Size() ; ++q ) batchCheck += batch.GetResult(q).value;
+  std::cout<<batch.Size()<<" queries: single methods "<<elapsed<<" s, QueryBatch "<<batch.GetElapsed()<<" s"
+	   <<" (sums: "<<check<<" , "<<batchCheck<<")"<<std::endl;
+}
+
+//Each thread adds its share of the particles: one in four is a secondary
+//of the primary (e.g. delta rays), the others are secondaries of particles
+//added by the same thread. Energy is accumulated a few times per particle
+void FillShared( int thread , int nThreads ) {
+  G4ShowerMap::Analysis* shared = G4ShowerMap::Analysis::SharedInstance();
+  for ( int id = 2+thread ; id <= nTracks ; id += nThreads ) {
+    const int parent = ( id%4 == 0 || id-nThreads < 2 ) ? 1 : id-nThreads;
+    shared->AddSecondary( id , parent , &species[id%nSpecies] , 0. );
+    for ( int step = 0 ; step < 4 ; ++step ) shared->Accumulate( id , 0.001 );
+  }
+}
+
+void Concurrent( int nThreads ) {
+  G4ShowerMap::Analysis* shared = G4ShowerMap::Analysis::SharedInstance();
+  shared->Clear();
+  shared->AddSecondary( 1 , 0 , &species[0] , 0. );
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  shared->BeginConcurrent();
+  std::vector<std::thread> workers;
+  for ( int t = 0 ; t < nThreads ; ++t ) workers.push_back( std::thread(FillShared,t,nThreads) );
+  for ( int t = 0 ; t < nThreads ; ++t ) workers[t].join();
+  shared->EndConcurrent();
+  const double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  std::cout<<"Concurrent fill with "<<nThreads<<" threads: "<<shared->Size()<<" particles in "
+	   <<elapsed<<" s"<<std::endl;
+}
+
+int main(int,char**) {
+  std::cout<<"Memory used by a shower of "<<nTracks<<" particles"<<std::endl;
+  std::cout<<"sizeof(Node)="<<sizeof(G4ShowerMap::internal::Node<G4ShowerMap::G4TrackData<G4double>,int>)
+	   <<" sizeof(CompactNode)="<<sizeof(G4ShowerMap::internal::CompactNode<G4double>)<<std::endl;
+  G4ShowerMap::Analysis* analysis = G4ShowerMap::Analysis::Instance();
+  Fill( *analysis , "Analysis" , allocated );
+  Queries( *analysis );
+  G4ShowerMap::CompactAnalysis* compact = G4ShowerMap::CompactAnalysis::Instance();
+  const size_t before = allocated;
+  compact->Reserve( nTracks );
+  Fill( *compact , "CompactAnalysis" , before );
+  analysis->Clear();
+  compact->Clear();
+  DeltaRays( *analysis , "Analysis" );
+  DeltaRays( *compact , "CompactAnalysis" );
+
+  std::cout<<"Concurrent filling of "<<nTracks<<" particles, hardware threads: "
+	   <<std::thread::hardware_concurrency()<<std::endl;
+  for ( int nThreads = 1 ; nThreads <= 16 ; nThreads *= 2 ) Concurrent( nThreads );
+  return 0;
+}
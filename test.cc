@@ -18,6 +18,7 @@
 #include <iostream>
 #include <sstream>
 #include <cmath>
+#include <thread>
 
 
 //For testing define some particles  
@@ -27,6 +28,56 @@ namespace {
   G4ParticleDefinition proton   = "p";
 }
 
+//Stress test of concurrent insertion: several threads fill the same shared map,
+//each one building a binary tree of tracks below the common primary (id=1).
+//Ids of different threads are interleaved so that all threads hit all shards.
+namespace {
+  const int nThreads = 16;
+  const int nTracks = 5000; //per thread
+  int TrackId( int thread , int k ) { return 2 + thread + k*nThreads; }
+  int ParentId( int thread , int k ) { return k==0 ? 1 : TrackId(thread,(k-1)/2); }
+
+  void FillShared( int thread ) {
+    G4ShowerMap::Analysis* shared = G4ShowerMap::Analysis::SharedInstance();
+    for ( int k = 0 ; k < nTracks ; ++k ) {
+      shared->AddSecondary( TrackId(thread,k) , ParentId(thread,k) , (k%2?&electron:&positron) , 0. );
+      shared->Update( TrackId(thread,k) , 1. );
+      if ( k%10 == 0 ) shared->Accumulate( 1 , 1. ); //All threads on the same particle
+    }
+  }
+
+  void StressConcurrent() {
+    G4ShowerMap::Analysis* shared = G4ShowerMap::Analysis::SharedInstance();
+    shared->AddSecondary( 1 , 0 , &proton , 1. );
+    shared->BeginConcurrent();
+    std::vector<std::thread> workers;
+    for ( int t = 0 ; t < nThreads ; ++t ) workers.push_back( std::thread(FillShared,t) );
+    for ( int t = 0 ; t < nThreads ; ++t ) workers[t].join();
+    shared->EndConcurrent(); //Barrier
+
+    TEST( shared->Size()==1+nThreads*nTracks , "Wrong size of concurrent container");
+    std::vector<int> ids;
+    TEST( shared->GetSecondariesIds(1,ids) && ids.size()==nThreads , "Wrong secondaries of primary");
+    for ( int t = 0 ; t < nThreads ; ++t ) {
+      for ( int k = 0 ; k < nTracks ; ++k ) {
+	const int id = TrackId(t,k);
+	shared->Select(id);
+	TEST( shared->SelectParent() && shared->GetCurrentId()==ParentId(t,k) , "Wrong parent in concurrent container");
+	ids.clear();
+	shared->GetSecondariesIds(id,ids);
+	const size_t nchildren = (2*k+1<nTracks) + (2*k+2<nTracks);
+	TEST( ids.size()==nchildren , "Wrong number of secondaries in concurrent container");
+	for ( size_t i = 0 ; i < ids.size() ; ++i ) 
+	  TEST( ids[i]==TrackId(t,2*k+1+i) , "Wrong secondaries in concurrent container");
+      }
+    }
+    shared->Select(1);
+    TEST( fabs(shared->SumBranch()-(1+nThreads*nTracks+nThreads*nTracks/10))<0.000001 , "Wrong branch sum in concurrent container");
+    shared->Clear();
+    TEST( shared->Size()==0 , "Wrong size of concurrent container");
+  }
+}
+
 int main(int,char**) {
   std::cout<<"Testing G4ShowerMap, if any test fails a message is issued and programs stops"<<std::endl;
 
@@ -211,11 +262,183 @@ int main(int,char**) {
     ++idx;
   }
 
+  //Accumulate values (e.g. energy deposited at each step)
+  result = instance->Accumulate( 4 , 0.1 );
+  TEST( result , "Wrong accumulate");
+  result = instance->Accumulate( 4 , 0.2 );
+  TEST( result , "Wrong accumulate");
+  result = instance->Accumulate( 4 , 1000. , elefilter );
+  TEST( !result , "Wrong accumulate");
+  result = instance->Accumulate( 100 , 1000. );
+  TEST( !result , "Wrong accumulate of non existing id");
+  result = instance->GetValue( 4 , value );
+  TEST( result && fabs(value-0.7)<0.0000001 , "Wrong value after accumulate");
+  std::vector<std::pair<int,G4double> > deltas;
+  deltas.push_back( std::make_pair( 4 , -0.1 ) );
+  deltas.push_back( std::make_pair( 4 , -0.1 ) );
+  deltas.push_back( std::make_pair( 100 , 1000. ) );
+  deltas.push_back( std::make_pair( 4 , -0.1 ) );
+  TEST( instance->Accumulate( deltas )==3 , "Wrong batched accumulate");
+  result = instance->GetValue( 4 , value );
+  TEST( result && fabs(value-0.4)<0.0000001 , "Wrong value after batched accumulate");
+
+  //Batch of queries evaluated together, results must be the same as 
+  //the ones of the single methods
+  G4ShowerMap::QueryBatch batch;
+  size_t q1 = batch.AddValue( 4 );
+  size_t q2 = batch.AddValue( 4 , elefilter );
+  size_t q3 = batch.AddSumParents( 6 , elefilter );
+  size_t q4 = batch.AddSumParents( 4 , posifilter );
+  size_t q5 = batch.AddSumParents( 8 );
+  size_t q6 = batch.AddSumSecondaries( 4 , elefilter );
+  size_t q7 = batch.AddSumSecondaries( 5 , pfilter );
+  size_t q8 = batch.AddSumBranch( 4 );
+  size_t q9 = batch.AddSumBranch( 1 , elefilter );
+  size_t q10 = batch.AddSumBranch( 1 );
+  size_t q11 = batch.AddSumBranch( 5 , posifilter );
+  size_t q12 = batch.AddValue( 100 );
+  TEST( batch.Size()==12 , "Wrong size of batch");
+  batch.Run( *instance );
+  TEST( batch.GetResults().size()==12 , "Wrong number of batch results");
+  TEST( batch.GetElapsed()>=0 , "Wrong batch timing");
+  TEST( batch.GetResult(q1).found && fabs(batch.GetResult(q1).value-0.4)<0.0000001 , "Wrong batch value");
+  TEST( !batch.GetResult(q2).found && batch.GetResult(q2).value==0 , "Wrong batch value");
+  TEST( batch.GetResult(q3).found && fabs(batch.GetResult(q3).value-0.3)<0.0000001 , "Wrong batch sum parents");
+  TEST( !batch.GetResult(q4).found && batch.GetResult(q4).value==0 , "Wrong batch sum parents");
+  TEST( batch.GetResult(q5).found && fabs(batch.GetResult(q5).value-0.8)<0.0000001 , "Wrong batch sum parents");
+  TEST( batch.GetResult(q6).found && fabs(batch.GetResult(q6).value-0.7)<0.0000001 , "Wrong batch sum secondaries");
+  TEST( !batch.GetResult(q7).found && batch.GetResult(q7).value==0 , "Wrong batch sum secondaries");
+  TEST( batch.GetResult(q8).found && fabs(batch.GetResult(q8).value-1.7)<0.0000001 , "Wrong batch sum branch");
+  TEST( batch.GetResult(q9).found && fabs(batch.GetResult(q9).value-1.)<0.0000001 , "Wrong batch sum branch");
+  TEST( batch.GetResult(q10).found && fabs(batch.GetResult(q10).value-4.5)<0.0000001 , "Wrong batch sum branch");
+  TEST( batch.GetResult(q11).found && fabs(batch.GetResult(q11).value-0.8)<0.0000001 , "Wrong batch sum branch");
+  TEST( !batch.GetResult(q12).found , "Wrong batch value for non existing id");
+  batch.Clear();
+  TEST( batch.Size()==0 , "Wrong size of batch");
+
+  //Sums of parents whose walk reaches a particle already queried (memoized),
+  //with repeated queries, compared to the single method
+  const int chainIds[] = { 4 , 6 , 1 , 2 , 7 , 2 , 8 , 5 };
+  const int nChain = sizeof(chainIds)/sizeof(chainIds[0]);
+  std::vector<size_t> all, ele;
+  for ( int i = 0 ; i < nChain ; ++i ) {
+    all.push_back( batch.AddSumParents( chainIds[i] ) );
+    ele.push_back( batch.AddSumParents( chainIds[i] , elefilter ) );
+  }
+  batch.Run( *instance );
+  for ( int i = 0 ; i < nChain ; ++i ) {
+    value = 0;
+    result = instance->GetSumParents( chainIds[i] , value );
+    TEST( batch.GetResult(all[i]).found==result && fabs(batch.GetResult(all[i]).value-value)<0.0000001 , "Wrong batch sum parents of "<<chainIds[i]);
+    value = 0;
+    result = instance->GetSumParents( chainIds[i] , value , elefilter );
+    TEST( batch.GetResult(ele[i]).found==result && fabs(batch.GetResult(ele[i]).value-value)<0.0000001 , "Wrong batch sum parents of "<<chainIds[i]);
+  }
+  batch.Clear();
+
+  //Same shower in the compact map, results must be the same
+  G4ShowerMap::CompactAnalysis* compact = G4ShowerMap::CompactAnalysis::Instance();
+  compact->AddSecondary( 1 , 0 ,    &electron , 0.1 );
+  compact->AddSecondary( 2 , 1 ,    &electron , 0.2 );
+  compact->AddSecondary( 3 , 2 ,    &positron , 0.3 );
+  compact->AddSecondary( 4 , 2 ,    &proton, 0.4 );
+  compact->AddSecondary( 5 , 2 ,    &proton, 0.5 );
+  compact->AddSecondary( 6 , 4 ,    &proton, 0.6 );
+  compact->AddSecondary( 7 , 4 ,    &electron, 0.7 );
+  compact->AddSecondary( 8 , 5 ,    &positron, 0.8 );
+  compact->AddSecondary( 9 , 2 ,    &proton, 0.9 );
+  //Invalid ids are rejected
+  TEST( !compact->AddSecondary( 0 , 1 ,    &proton, 1. ) , "Compact accepts id 0");
+  TEST( !compact->AddSecondary( -1 , 1 ,   &proton, 1. ) , "Compact accepts negative id");
+  TEST( !compact->AddSecondary( compact->GetMaxId()+1 , 1 , &proton, 1. ) , "Compact accepts too large id");
+  std::cout<<"Compact shower map is:\n"<<*compact<<std::endl;
+  TEST( sizeof(G4ShowerMap::internal::CompactNode<G4double>)<=24 , "Compact node too large");
+  TEST( compact->Size()==9 && compact->Exists(9) && !compact->Exists(10) && !compact->Exists(0) && !compact->Exists(-1) , "Wrong compact size");
+  TEST( compact->Matches(2,elefilter) && !compact->Matches(3,elefilter) , "Wrong compact match");
+  compact->Select(8);
+  TEST( compact->GetData().pdef==&positron , "Wrong compact species");
+  result = compact->ParentMatches(8,pid,elefilter);
+  TEST( result && pid==2 , "Wrong compact parent match");
+  result = compact->GetValue( 4 , value , elefilter );
+  TEST( !result && value==0 , "Wrong compact value");
+  result = compact->GetSumParents( 6 , value , elefilter );
+  TEST( result && fabs(value-0.3)<0.0000001 , "Wrong compact sum parents");
+  value = 0;
+  result = compact->GetSumSecondaries( 4 , value , elefilter );
+  TEST( result && fabs(value-0.7)<0.0000001 , "Wrong compact sum secondaries");
+  ids.clear();
+  result = compact->GetSecondariesIds( 2 , ids , pfilter );
+  TEST( result && ids.size()==3 &&ids[0]==4&&ids[1]==5&&ids[2]==9 , "Wrong compact secondaries");
+  compact->Select(1);
+  TEST( fabs(compact->SumBranch()-4.5)<0.0000001 , "Wrong compact sum branch");
+  TEST( fabs(compact->SumBranch(elefilter)-1.)<0.0000001 , "Wrong compact sum branch");
+  compact->Select(4);
+  TEST( fabs(compact->SumBranch()-1.7)<0.0000001 , "Wrong compact sum branch");
+  TEST( fabs(compact->SumChildren()-1.3)<0.0000001 , "Wrong compact sum children");
+  TEST( compact->SumSiblings()==2.1 , "Wrong compact sum siblings");
+  heads.clear();
+  result = compact->GetHeads( heads, pfilter );
+  TEST( result && heads.size()==3 && heads[0]==4&&heads[1]==5&&heads[2]==9 , "Wrong compact heads");
+  TEST( compact->First()->first==1 && (--compact->End())->first==9 , "Wrong compact iterators");
+  idx = 1;
+  for ( G4ShowerMap::CompactAnalysis::const_iterator cit = compact->First() ; cit != compact->End() ; ++cit , ++idx ) {
+    std::pair<int,G4ShowerMap::CompactAnalysis::struct_type> info = G4ShowerMap::CompactAnalysis::GetInfo( cit );
+    TEST( info.first==idx && fabs(info.second.data-idx/10.)<0.0000001 , "Wrong info from compact iterator");
+  }
+  TEST( idx==10 , "Wrong number of compact iterations");
+  //Queries in batch
+  size_t qc1 = batch.AddSumParents( 6 , elefilter );
+  size_t qc2 = batch.AddSumBranch( 1 );
+  batch.Run( *compact );
+  TEST( batch.GetResult(qc1).found && fabs(batch.GetResult(qc1).value-0.3)<0.0000001 , "Wrong compact batch sum parents");
+  TEST( batch.GetResult(qc2).found && fabs(batch.GetResult(qc2).value-4.5)<0.0000001 , "Wrong compact batch sum branch");
+  batch.Clear();
+  result = compact->Update( 4 , 1. ) && compact->Accumulate( 4 , 0.5 ) && !compact->Accumulate( 4 , 1. , elefilter );
+  TEST( result && compact->GetValue( 4 , value ) && fabs(value-1.5)<0.0000001 , "Wrong compact update");
+  compact->Clear();
+  TEST( compact->Size()==0 && !compact->Exists(1) && compact->First()==compact->End() , "Wrong size of compact container");
+
+  //A particle that is its own parent is a root, as in Analysis
+  TEST( compact->AddSecondary( 10 , 10 , &proton , 1. ) , "Wrong compact self parent");
+  result = compact->GetSumParents( 10 , value );
+  TEST( !result && value==0 , "Wrong compact self parent");
+  compact->Select(10);
+  TEST( !compact->SelectParent() , "Wrong compact self parent");
+  compact->Clear();
+
+  //Many secondaries of the same particle keep their order
+  const int nDeltas = 1000;
+  compact->AddSecondary( 1 , 0 , &electron , 0. );
+  for ( int d = 2 ; d <= nDeltas ; ++d ) compact->AddSecondary( d , 1 , &electron , 1. );
+  ids.clear();
+  TEST( compact->GetSecondariesIds( 1 , ids ) && ids.size()==size_t(nDeltas-1) , "Wrong number of compact secondaries");
+  for ( size_t i = 0 ; i < ids.size() ; ++i ) TEST( ids[i]==int(i)+2 , "Wrong order of compact secondaries");
+  compact->Select(1);
+  TEST( fabs(compact->SumBranch()-(nDeltas-1))<0.0000001 , "Wrong compact sum branch");
+  compact->Clear();
+
+  //Particle definitions are stored as 16-bit codes: further definitions are rejected
+  {
+    G4ShowerMap::CompactAnalysis keys;
+    const size_t nKeys = G4ShowerMap::CompactAnalysis::MaxKeys;
+    std::vector<G4ParticleDefinition> definitions( nKeys+1 );
+    for ( size_t k = 0 ; k < nKeys ; ++k ) TEST( keys.AddSecondary( 1 , 0 , &definitions[k] , 0. ) , "Wrong compact key");
+    TEST( !keys.AddSecondary( 2 , 0 , &definitions[nKeys] , 0. ) && !keys.Exists(2) , "Too many compact keys accepted");
+    keys.Select(1);
+    G4ShowerMap::CompactAnalysis::struct_type extra = { &definitions[nKeys] , 5. };
+    keys.UpdateCurrentValue( extra );
+    TEST( keys.GetData().pdef==&definitions[nKeys-1] , "Too many compact keys accepted");
+    TEST( keys.Accumulate( 1 , 1. ) && keys.GetValue( 1 , value ) && value==1. , "Wrong compact accumulate");
+  }
+
   //Empty map (e.g. prepare for new event)
   TEST( instance->Size()==9,"Wrong size of container");
   instance->Clear();
   TEST( instance->Size()==0, "Wrong size of container");
   std::cout<<"Nothing between arrows:->"<<*instance<<"<-"<<std::endl;
+
+  //Concurrent filling of a shared map
+  StressConcurrent();
   std::cout<<"END"<<std::endl;
   return 0;
 }